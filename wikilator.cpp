@@ -12,6 +12,8 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <cstdint>
+#include <thread>
+#include <vector>
 
 
 
@@ -20,7 +22,8 @@ constexpr size_t MAX_RAM = 10ULL * 1024 * 1024 * 1024;  // 10GB
 constexpr size_t MAX_DISK = 100ULL * 1024 * 1024 * 1024; // 100GB
 constexpr size_t ENWIK9_SIZE = 1000000000;  // enwik9 is 1GB
 constexpr size_t WINDOW_SIZE = 1 << 27;  // 128MB sliding window
-constexpr size_t MAX_MATCH = 255;        // Max match length
+constexpr size_t MIN_MATCH = 4;          // Shorter repeats stay literals
+constexpr size_t MAX_MATCH = 65535;      // Max match length
 constexpr size_t HASH_BITS = 27;         // 128M entries
 constexpr size_t HASH_SIZE = 1 << HASH_BITS;
 constexpr uint32_t HASH_MASK = HASH_SIZE - 1;
@@ -30,6 +33,14 @@ constexpr size_t L1_CACHE = 32768;     // 32KB
 constexpr size_t L2_CACHE = 262144;    // 256KB
 constexpr size_t CACHE_LINE = 64;      // Bytes
 
+// Engine tags (first byte of every compressed stream)
+constexpr uint8_t ENGINE_CM = 'C';     // context mixing (-c)
+constexpr uint8_t ENGINE_BWT = 'B';    // fast BWT (-f)
+
+// BWT engine: rows (n + 1) must fit the 24-bit index of the inverse transform
+constexpr size_t BWT_BLOCK_SIZE = (1 << 24) - 1;
+constexpr int BWT_ALPHABET = 257;      // RUNA, RUNB, MTF ranks 1..255
+
 // ====================== Memory Manager ========================
 class MemoryManager {
 private:
@@ -40,26 +51,25 @@ private:
 
 public:
     void* allocate(size_t size, size_t alignment = CACHE_LINE, bool critical = true) {
-        if (allocated + size > MAX_RAM) {
-            if (critical) {
-                fprintf(stderr, "Memory limit exceeded! Requested: %zu, Allocated: %zu, Max: %zu\n", 
-                        size, allocated, MAX_RAM);
-                exit(1);
-            }
-            return nullptr;
-        }
-        
         // Align the current offset
         size_t aligned_offset = (pool_offset + alignment - 1) & ~(alignment - 1);
         
-        // Check if we have space in the pool
+        // Carve from the pool when it fits; the pool was charged up front
         if (pool && (aligned_offset + size <= pool_size)) {
             void* ptr = pool + aligned_offset;
             pool_offset = aligned_offset + size;
-            allocated += size;
             return ptr;
         }
         
+        if (allocated + size > MAX_RAM) {
+            if (critical) {
+                fprintf(stderr, "Memory limit exceeded! Requested: %zu, Allocated: %zu, Max: %zu\n", 
+                        size, allocated, MAX_RAM);
+                exit(1);
+            }
+            return nullptr;
+        }
+        
         // Allocate new block
         void* ptr;
         if (posix_memalign(&ptr, alignment, size) != 0) {
@@ -71,6 +81,11 @@ public:
         return ptr;
     }
 
+    // Budget left for allocate(): unused pool plus what is still uncharged
+    size_t remaining() const {
+        return (MAX_RAM - allocated) + (pool ? pool_size - pool_offset : 0);
+    }
+
     void create_pool(size_t size) {
         if (pool) return;
         pool_size = size;
@@ -88,134 +103,385 @@ static MemoryManager mem_manager;
 // ====================== Fast ANS Implementation ========================
 class ANS {
 private:
-    uint32_t state = 1 << 16;
-    uint32_t buffer = 0;
-    int buffer_bits = 0;
+    static constexpr uint32_t STATE_LOW = 1 << 23;
+    static constexpr int PROB_BITS = 12;
+    static constexpr uint32_t PROB_SCALE = 1 << PROB_BITS;
+
+    // Encoder: rANS codes in reverse, so decisions are buffered and written
+    // out per segment as [uint32 decisions][uint32 bytes][state + bytes]
     FILE* output_file = nullptr;
+    uint16_t* pending = nullptr;        // (prob << 1) | bit
+    size_t pending_cap = 0;
+    size_t pending_count = 0;
     uint8_t* output_buf = nullptr;
     size_t buf_size = 0;
-    size_t buf_pos = 0;
-    
-    // Precomputed tables
-    uint16_t prob_table[256][256] = {{0}};
-    uint8_t symbol_table[4096] = {0};
-    uint16_t cumulative[256] = {0};
+
+    // Decoder
+    uint32_t state = 0;
+    const uint8_t* in_ptr = nullptr;
+    const uint8_t* in_end = nullptr;
+    const uint8_t* seg_end = nullptr;
+    uint32_t seg_left = 0;
+
+    static uint32_t clamp_prob(uint16_t prob) {
+        return std::min<uint32_t>(std::max<uint32_t>(prob, 1), PROB_SCALE - 1);
+    }
+
+    void next_segment() {
+        uint32_t header[2];
+        if (size_t(in_end - in_ptr) < sizeof(header)) corrupt_stream();
+        memcpy(header, in_ptr, sizeof(header));
+        in_ptr += sizeof(header);
+        if (header[0] == 0 || header[1] < 4 || size_t(in_end - in_ptr) < header[1])
+            corrupt_stream();
+
+        seg_left = header[0];
+        seg_end = in_ptr + header[1];
+        memcpy(&state, in_ptr, 4);
+        in_ptr += 4;
+    }
+
+    [[noreturn]] static void corrupt_stream() {
+        fprintf(stderr, "Corrupt ANS stream\n");
+        exit(1);
+    }
 
 public:
-    ANS(FILE* file, size_t buf_size = 1 << 20) : output_file(file), buf_size(buf_size) {
-        output_buf = static_cast<uint8_t*>(mem_manager.allocate(buf_size));
-        buf_pos = 0;
-        
-        // Initialize probability tables
-        for (int i = 0; i < 256; i++) {
-            cumulative[i] = i > 0 ? cumulative[i-1] + 1 : 1;
-            for (int j = 0; j < 256; j++) {
-                prob_table[i][j] = (i * j) >> 8;
+    // buf_size: binary decisions buffered per segment
+    ANS(FILE* file, size_t buf_size = 1 << 20) : output_file(file), pending_cap(buf_size) {
+        pending = static_cast<uint16_t*>(mem_manager.allocate(pending_cap * sizeof(uint16_t)));
+        // At most PROB_BITS bits per decision, plus the final state
+        this->buf_size = pending_cap * 2 + 16;
+        output_buf = static_cast<uint8_t*>(mem_manager.allocate(this->buf_size));
+    }
+
+    // prob: probability of symbol 0, in 1/4096
+    void encode_symbol(uint8_t symbol, uint16_t prob) {
+        pending[pending_count++] = (clamp_prob(prob) << 1) | (symbol ? 1 : 0);
+        if (pending_count == pending_cap) flush();
+    }
+
+    void begin_decode(const uint8_t* src, size_t size) {
+        in_ptr = src;
+        in_end = src + size;
+        seg_left = 0;
+    }
+
+    uint8_t decode_symbol(uint16_t prob) {
+        if (seg_left == 0) {
+            if (seg_end) in_ptr = seg_end;
+            next_segment();
+        }
+        seg_left--;
+
+        uint32_t p = clamp_prob(prob);
+        uint32_t slot = state & (PROB_SCALE - 1);
+        uint8_t symbol = slot >= p;
+        uint32_t freq = symbol ? PROB_SCALE - p : p;
+        uint32_t start = symbol ? p : 0;
+        state = freq * (state >> PROB_BITS) + slot - start;
+        while (state < STATE_LOW && in_ptr < seg_end) state = (state << 8) | *in_ptr++;
+        return symbol;
+    }
+
+    // Codes the buffered decisions as one segment
+    void flush() {
+        if (pending_count == 0) return;
+
+        uint8_t* end = output_buf + buf_size;
+        uint8_t* ptr = end;
+        uint32_t x = STATE_LOW;
+        for (size_t i = pending_count; i-- > 0;) {
+            uint32_t p = pending[i] >> 1;
+            uint32_t freq = (pending[i] & 1) ? PROB_SCALE - p : p;
+            uint32_t start = (pending[i] & 1) ? p : 0;
+            uint32_t x_max = ((STATE_LOW >> PROB_BITS) << 8) * freq;
+            while (x >= x_max) {
+                *--ptr = x & 0xFF;
+                x >>= 8;
             }
+            x = ((x / freq) << PROB_BITS) + (x % freq) + start;
         }
-        
-        // Initialize symbol table
-        for (int i = 0; i < 4096; i++) {
-            symbol_table[i] = i & 0xFF;
+        ptr -= 4;
+        memcpy(ptr, &x, 4);
+
+        uint32_t header[2] = { uint32_t(pending_count), uint32_t(end - ptr) };
+        fwrite(header, sizeof(uint32_t), 2, output_file);
+        fwrite(ptr, 1, header[1], output_file);
+        pending_count = 0;
+    }
+
+    // ---- Static-frequency block coding (rANS, used by the BWT engine) ----
+    // Symbols are split into segments of BLOCK_SEGMENT, each with its own
+    // frequency table: [varint freqs][uint32 byte count][rANS bytes].
+    static constexpr int BLOCK_PROB_BITS = 14;
+    static constexpr uint32_t BLOCK_PROB_SCALE = 1 << BLOCK_PROB_BITS;
+    static constexpr uint32_t BLOCK_STATE_LOW = 1 << 23;
+    static constexpr size_t BLOCK_SEGMENT = 1 << 18;
+    static constexpr int BLOCK_MAX_ALPHABET = 512;
+
+    // Worst-case output size of encode_block() for n symbols
+    static size_t block_bound(size_t n, int alphabet) {
+        size_t segments = n / BLOCK_SEGMENT + 1;
+        return n * 2 + segments * (alphabet * 3 + 8) + 64;
+    }
+
+    static size_t encode_block(const uint16_t* syms, size_t n, int alphabet,
+                               uint8_t* out, size_t cap) {
+        size_t pos = 0;
+        uint32_t freq[BLOCK_MAX_ALPHABET];
+        uint32_t cum[BLOCK_MAX_ALPHABET];
+
+        for (size_t start = 0; start < n; start += BLOCK_SEGMENT) {
+            size_t count = std::min(BLOCK_SEGMENT, n - start);
+            build_freqs(syms + start, count, alphabet, freq, cum);
+            for (int s = 0; s < alphabet; s++) pos += put_varint(out + pos, freq[s]);
+
+            // rANS runs backwards; emit from the end of the buffer, then move
+            uint8_t* end = out + cap;
+            uint8_t* ptr = end;
+            uint32_t x = BLOCK_STATE_LOW;
+            for (size_t i = start + count; i-- > start;) {
+                uint32_t f = freq[syms[i]];
+                uint32_t x_max = ((BLOCK_STATE_LOW >> BLOCK_PROB_BITS) << 8) * f;
+                while (x >= x_max) {
+                    *--ptr = x & 0xFF;
+                    x >>= 8;
+                }
+                x = ((x / f) << BLOCK_PROB_BITS) + (x % f) + cum[syms[i]];
+            }
+            ptr -= 4;
+            memcpy(ptr, &x, 4);
+
+            uint32_t bytes = end - ptr;
+            memcpy(out + pos, &bytes, 4);
+            pos += 4;
+            memmove(out + pos, ptr, bytes);
+            pos += bytes;
         }
+        return pos;
     }
 
-    void encode_symbol(uint8_t symbol, uint16_t prob) {
-        uint32_t x = state;
-        uint32_t freq = prob;
-        uint32_t slot = x & 0xFFFF;
-        
-        // Normalization
-        if (x < (1 << 28)) {
-            buffer |= x << buffer_bits;
-            buffer_bits += 16;
-            x >>= 16;
-            
-            while (buffer_bits >= 8) {
-                output_buf[buf_pos++] = buffer & 0xFF;
-                if (buf_pos == buf_size) flush();
-                buffer >>= 8;
-                buffer_bits -= 8;
+    // Returns the number of input bytes consumed
+    static size_t decode_block(const uint8_t* in, size_t avail, uint16_t* syms,
+                               size_t n, int alphabet) {
+        size_t pos = 0;
+        uint32_t freq[BLOCK_MAX_ALPHABET];
+        uint32_t cum[BLOCK_MAX_ALPHABET];
+        uint16_t slot_table[BLOCK_PROB_SCALE];
+
+        for (size_t start = 0; start < n; start += BLOCK_SEGMENT) {
+            size_t count = std::min(BLOCK_SEGMENT, n - start);
+            uint32_t total = 0;
+            for (int s = 0; s < alphabet; s++) {
+                if (pos >= avail) corrupt_block();
+                pos += get_varint(in + pos, avail - pos, freq[s]);
+                cum[s] = total;
+                total += freq[s];
+                if (total > BLOCK_PROB_SCALE) corrupt_block();
+                for (uint32_t k = cum[s]; k < total; k++) slot_table[k] = s;
+            }
+            if (total != BLOCK_PROB_SCALE) corrupt_block();
+
+            uint32_t bytes;
+            if (avail - pos < 4) corrupt_block();
+            memcpy(&bytes, in + pos, 4);
+            pos += 4;
+            if (bytes < 4 || avail - pos < bytes) corrupt_block();
+
+            const uint8_t* ptr = in + pos;
+            const uint8_t* end = ptr + bytes;
+            uint32_t x;
+            memcpy(&x, ptr, 4);
+            ptr += 4;
+            for (size_t i = start; i < start + count; i++) {
+                uint32_t slot = x & (BLOCK_PROB_SCALE - 1);
+                uint16_t s = slot_table[slot];
+                syms[i] = s;
+                x = freq[s] * (x >> BLOCK_PROB_BITS) + slot - cum[s];
+                while (x < BLOCK_STATE_LOW && ptr < end) x = (x << 8) | *ptr++;
             }
+            pos += bytes;
         }
-        
-        // Encoding
-        state = (x / 4096) * freq + slot + (symbol ? (4096 - freq) : 0);
+        return pos;
     }
 
-    uint8_t decode_symbol(uint16_t prob) {
-        uint32_t x = state;
-        uint32_t threshold = prob * (x >> 12);
-        
-        if ((x & 0xFFF) < threshold) {
-            state = (x >> 12) * prob + (x & 0xFFF);
-            return 0;
-        } else {
-            state = (x >> 12) * (4096 - prob) + ((x & 0xFFF) - threshold);
-            return 1;
+private:
+    // Scale symbol counts to BLOCK_PROB_SCALE, keeping every used symbol > 0
+    static void build_freqs(const uint16_t* syms, size_t n, int alphabet,
+                            uint32_t* freq, uint32_t* cum) {
+        uint64_t count[BLOCK_MAX_ALPHABET] = {0};
+        for (size_t i = 0; i < n; i++) count[syms[i]]++;
+
+        int64_t sum = 0;
+        int largest = 0;
+        for (int s = 0; s < alphabet; s++) {
+            freq[s] = count[s] ? std::max<uint64_t>(1, count[s] * BLOCK_PROB_SCALE / n) : 0;
+            sum += freq[s];
+            if (freq[s] > freq[largest]) largest = s;
+        }
+        if (sum < BLOCK_PROB_SCALE) freq[largest] += BLOCK_PROB_SCALE - sum;
+        while (sum > BLOCK_PROB_SCALE) {
+            // Steal from the current largest symbol one count at a time
+            for (int s = 0; s < alphabet; s++)
+                if (freq[s] > freq[largest]) largest = s;
+            freq[largest]--;
+            sum--;
+        }
+
+        uint32_t total = 0;
+        for (int s = 0; s < alphabet; s++) {
+            cum[s] = total;
+            total += freq[s];
         }
     }
 
-    void flush() {
-        while (state > 1) {
-            output_buf[buf_pos++] = state & 0xFF;
-            if (buf_pos == buf_size) {
-                fwrite(output_buf, 1, buf_size, output_file);
-                buf_pos = 0;
-            }
-            state >>= 8;
+    static size_t put_varint(uint8_t* out, uint32_t v) {
+        size_t len = 0;
+        while (v >= 0x80) {
+            out[len++] = (v & 0x7F) | 0x80;
+            v >>= 7;
         }
-        fwrite(output_buf, 1, buf_pos, output_file);
-        buf_pos = 0;
+        out[len++] = v;
+        return len;
+    }
+
+    static size_t get_varint(const uint8_t* in, size_t avail, uint32_t& v) {
+        size_t len = 0;
+        v = 0;
+        for (int shift = 0; len < avail && shift < 32; shift += 7) {
+            uint8_t b = in[len++];
+            v |= uint32_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return len;
+        }
+        corrupt_block();
+        return len;
+    }
+
+    [[noreturn]] static void corrupt_block() {
+        fprintf(stderr, "Corrupt BWT block in compressed stream\n");
+        exit(1);
     }
 };
 
 // ====================== Context Models ========================
+// Probabilities are 16-bit P(1); ANS takes P(0) in 1/4096
+inline uint16_t zero_prob(uint16_t p) { return 4096 - (p >> 4); }
+
+inline void adapt_prob(uint16_t& p, int bit, int rate) {
+    if (bit) p += (65535 - p) >> rate;
+    else p -= p >> rate;
+}
+
 class ContextModel {
 private:
     uint16_t* state_table = nullptr;
-    uint32_t* hash_table = nullptr;
     size_t table_size = 0;
-    uint32_t mask = 0;
     uint64_t context = 0;
-    uint8_t history[64] = {0};
-    int hist_pos = 0;
+    uint32_t base = 0;      // Hash of context, refreshed per byte
+    uint32_t bucket = 0;    // 16-entry bucket for the current nibble
+    uint32_t node = 1;      // Position in the nibble's bit tree (1..15)
+    int bucket_shift = 0;
 
 public:
     ContextModel(size_t size) {
         table_size = 1 << (int)log2(size);
-        mask = table_size - 1;
-        hash_table = static_cast<uint32_t*>(mem_manager.allocate(table_size * sizeof(uint32_t), 64));
+        bucket_shift = 32 - ((int)log2(table_size) - 4);
         state_table = static_cast<uint16_t*>(mem_manager.allocate(table_size * sizeof(uint16_t), 64));
-        memset(hash_table, 0, table_size * sizeof(uint32_t));
-        memset(state_table, 0, table_size * sizeof(uint16_t));
+        for (size_t i = 0; i < table_size; i++) state_table[i] = 0x8000;
     }
 
     // Update model with new byte
     void update(uint8_t byte) {
-        history[hist_pos] = byte;
-        hist_pos = (hist_pos + 1) & 0x3F;
         context = (context << 8) | byte;
-        
-        // Update hash table
-        uint32_t hash = (context * 0x9E3779B1) & mask;
-        if (hash_table[hash] != (context & 0xFFFFFF)) {
-            hash_table[hash] = context & 0xFFFFFF;
-            state_table[hash] = 0x800;
+        base = context * 0x9E3779B1;
+    }
+
+    // Update with a run of copied bytes; base hashes only the low 32 bits
+    // of context, so just the last 4 bytes matter
+    void update_bulk(const uint8_t* data, size_t len) {
+        for (size_t i = len > 4 ? len - 4 : 0; i < len; i++)
+            context = (context << 8) | data[i];
+        base = context * 0x9E3779B1;
+    }
+
+    // Start loading the first nibble's bucket for the coming byte
+    void prefetch(uint32_t salt = 0) {
+        uint32_t h = (base + salt * 0x2F0B4C27 + 0x6F4F2A35) * 0x9E3779B1;
+        _mm_prefetch(reinterpret_cast<const char*>(state_table + ((h >> bucket_shift) << 4)),
+                     _MM_HINT_T0);
+    }
+
+    // Predict the next bit given the partial byte c0 (1..255). The hash is
+    // taken once per nibble and picks a 32-byte bucket, so the four bits
+    // of a nibble share one cache line.
+    uint16_t predict(uint32_t c0, uint32_t salt = 0) {
+        if (c0 == 1 || (c0 >> 4) == 1) {
+            uint32_t h = (base + salt * 0x2F0B4C27 + c0 * 0x6F4F2A35) * 0x9E3779B1;
+            bucket = (h >> bucket_shift) << 4;
+            node = 1;
         }
-        
-        // Update state with fast adaptation
-        state_table[hash] = (state_table[hash] * 15 + byte * 16 + 8) >> 4;
+        return state_table[bucket + node];
+    }
+
+    void update_bit(int bit) {
+        adapt_prob(state_table[bucket + node], bit, 4);
+        node = node * 2 + bit;
+    }
+};
+
+// ====================== Match Coding ========================
+// Adaptive binary code for match lengths and distances (values >= 1):
+// the index of the top bit through a 5-bit tree, then each lower bit
+// under its own (top bit, position) probability.
+class NumberModel {
+private:
+    uint16_t top_bit[32];
+    uint16_t low_bits[32][32];
+
+public:
+    NumberModel() {
+        std::fill_n(top_bit, 32, 0x8000);
+        std::fill_n(&low_bits[0][0], 32 * 32, 0x8000);
     }
 
-    // Predict next byte probability
-    uint16_t predict() {
-        uint32_t hash = (context * 0x9E3779B1) & mask;
-        return state_table[hash];
+    void encode(ANS& ans, uint32_t value) {
+        int n = 31 - __builtin_clz(value);
+        for (int b = 4, node = 1; b >= 0; b--) {
+            int bit = (n >> b) & 1;
+            ans.encode_symbol(bit, zero_prob(top_bit[node]));
+            adapt_prob(top_bit[node], bit, 5);
+            node = node * 2 + bit;
+        }
+        for (int k = n - 1; k >= 0; k--) {
+            int bit = (value >> k) & 1;
+            ans.encode_symbol(bit, zero_prob(low_bits[n][k]));
+            adapt_prob(low_bits[n][k], bit, 5);
+        }
+    }
+
+    uint32_t decode(ANS& ans) {
+        int node = 1;
+        for (int b = 4; b >= 0; b--) {
+            int bit = ans.decode_symbol(zero_prob(top_bit[node]));
+            adapt_prob(top_bit[node], bit, 5);
+            node = node * 2 + bit;
+        }
+        int n = node - 32;
+        uint32_t value = 1;
+        for (int k = n - 1; k >= 0; k--) {
+            int bit = ans.decode_symbol(zero_prob(low_bits[n][k]));
+            adapt_prob(low_bits[n][k], bit, 5);
+            value = (value << 1) | bit;
+        }
+        return value;
     }
 };
 
 // ====================== Match Finder ========================
+// The encoder searches the mmap'd input through hash chains; the window
+// is the decoder's history that matches are copied from. Each side only
+// allocates its own half.
 class MatchFinder {
 private:
     uint8_t* window = nullptr;
@@ -224,57 +490,86 @@ private:
     uint32_t window_pos = 0;
     uint32_t window_mask = 0;
 
+    static uint32_t hash(const uint8_t* p) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return (v * 0x9E3779B1) >> (32 - HASH_BITS);
+    }
+
 public:
-    MatchFinder() {
-        window = static_cast<uint8_t*>(mem_manager.allocate(WINDOW_SIZE, 64));
-        hash_table = static_cast<uint32_t*>(mem_manager.allocate(HASH_SIZE * sizeof(uint32_t), 64));
-        prev_table = static_cast<uint32_t*>(mem_manager.allocate(WINDOW_SIZE * sizeof(uint32_t), 64));
+    explicit MatchFinder(bool compress) {
         window_mask = WINDOW_SIZE - 1;
-        memset(hash_table, 0, HASH_SIZE * sizeof(uint32_t));
-        memset(prev_table, 0, WINDOW_SIZE * sizeof(uint32_t));
+        if (compress) {
+            hash_table = static_cast<uint32_t*>(mem_manager.allocate(HASH_SIZE * sizeof(uint32_t), 64));
+            prev_table = static_cast<uint32_t*>(mem_manager.allocate(WINDOW_SIZE * sizeof(uint32_t), 64));
+            // prev_table needs no clearing: a slot is only followed after
+            // insert() has written it
+            memset(hash_table, 0, HASH_SIZE * sizeof(uint32_t));
+        } else {
+            window = static_cast<uint8_t*>(mem_manager.allocate(WINDOW_SIZE, 64));
+        }
     }
 
-    // Find best match in sliding window
-    uint32_t find_match(uint8_t* data, uint32_t pos, uint32_t max_len, uint32_t& match_len) {
-        if (pos < 4) return 0;
-        
-        uint32_t hash = (*(uint32_t*)(data + pos) * 0x9E3779B1) & HASH_MASK;
-        uint32_t best_match = 0;
-        uint32_t best_len = 0;
+    // Encoder: find best match for data[pos..] in the window; returns its distance
+    uint32_t find_match(const uint8_t* data, size_t pos, size_t size, uint32_t& match_len) {
+        match_len = 0;
+        if (pos == 0 || pos + 4 > size) return 0;
+
+        uint32_t max_len = std::min<size_t>(MAX_MATCH, size - pos);
+        uint32_t best_dist = 0;
         uint32_t limit = 32;  // Limit chain length for speed
-        
-        uint32_t cur = hash_table[hash];
-        hash_table[hash] = window_pos;
-        
+        uint32_t cur = hash_table[hash(data + pos)];
+
+        // Entries hold position + 1 so that 0 always means "empty"
         for (uint32_t i = 0; i < limit && cur != 0; i++) {
-            uint32_t match_pos = cur;
+            uint32_t dist = uint32_t(pos) - (cur - 1);
+            if (dist == 0 || dist >= WINDOW_SIZE || dist > pos) break;
+
+            // Find match length (may overlap the current position)
+            const uint8_t* src = data + pos - dist;
             uint32_t len = 0;
-            
-            // Find match length
-            while (len < max_len && data[pos + len] == window[(match_pos + len) & window_mask]) {
-                len++;
-            }
-            
-            if (len > best_len) {
-                best_len = len;
-                best_match = match_pos;
+            while (len < max_len && data[pos + len] == src[len]) len++;
+
+            if (len > match_len) {
+                match_len = len;
+                best_dist = dist;
+                if (len == max_len) break;
             }
-            
+
             // Follow chain
-            cur = prev_table[match_pos & window_mask];
+            cur = prev_table[(cur - 1) & window_mask];
         }
-        
-        match_len = best_len;
-        return best_match;
+
+        return best_dist;
     }
 
-    // Update window with new data
-    void update(uint8_t* data, uint32_t pos, uint32_t len) {
+    // Encoder: index positions [pos, pos + len) for later searches
+    void insert(const uint8_t* data, size_t pos, size_t len, size_t size) {
+        size_t end = std::min(pos + len, size >= 4 ? size - 3 : 0);
+        for (; pos < end; pos++) {
+            uint32_t h = hash(data + pos);
+            prev_table[pos & window_mask] = hash_table[h];
+            hash_table[h] = pos + 1;
+        }
+    }
+
+    // Decoder: append decoded bytes to the window
+    void update(const uint8_t* data, uint32_t len) {
         for (uint32_t i = 0; i < len; i++) {
-            window[window_pos] = data[pos + i];
+            window[window_pos] = data[i];
             window_pos = (window_pos + 1) & window_mask;
         }
     }
+
+    // Decoder: copy a match out of the window (byte-wise, so overlaps repeat)
+    void copy(uint8_t* dst, uint32_t dist, uint32_t len) {
+        for (uint32_t i = 0; i < len; i++) {
+            uint8_t b = window[(window_pos - dist) & window_mask];
+            window[window_pos] = b;
+            window_pos = (window_pos + 1) & window_mask;
+            dst[i] = b;
+        }
+    }
 };
 
 // ====================== XML Parser ========================
@@ -338,75 +633,115 @@ public:
 };
 
 // ====================== Main Engine ========================
+// LZ/CM hybrid. At each position the encoder codes a match flag; literals
+// go through the per-bit context models, while a match of MIN_MATCH or
+// more codes only its length and distance and skips the per-bit predictor
+// for every copied byte. Contexts are then brought forward in bulk.
+// Stream: ENGINE_CM, uint64 original size, ANS segments.
 class Wikilator {
 private:
     ANS ans;
-    ContextModel char_model{1 << 26};  // 64MB
-    ContextModel word_model{1 << 25};  // 32MB
+    ContextModel char_model{1 << 26};  // 128MB
+    ContextModel word_model{1 << 25};  // 64MB
     MatchFinder match_finder;
     XMLParser xml_parser;
+    NumberModel length_model;
+    NumberModel distance_model;
+    uint16_t match_flag[32];
+    uint32_t literal_count = 0;
+    bool last_was_match = false;
     FILE* input_file;
+    FILE* output_file;
     size_t input_size;
     bool compression_mode;
     uint8_t* input_map = nullptr;
     size_t map_size = 0;
 
-    // Cache-optimized processing
-    void process_data(uint8_t* data, size_t size) {
-        uint32_t last_match_pos = 0;
-        uint32_t last_match_len = 0;
-        uint32_t literal_count = 0;
-        
-        for (size_t i = 0; i < size; i++) {
-            xml_parser.update(data[i]);
+    uint16_t& flag_prob() {
+        return match_flag[(last_was_match ? 16 : 0) + literal_count];
+    }
+
+    uint16_t predict_bit(uint32_t c0, uint32_t xml_context) {
+        uint16_t char_prob = char_model.predict(c0);
+        uint16_t word_prob = word_model.predict(c0, xml_context);
+        return (char_prob + word_prob) >> 1;
+    }
+
+    void update_bit(int bit) {
+        char_model.update_bit(bit);
+        word_model.update_bit(bit);
+    }
+
+    void update_literal(uint8_t byte) {
+        char_model.update(byte);
+        word_model.update(byte);
+        xml_parser.update(byte);
+        literal_count = std::min<uint32_t>(literal_count + 1, 15);
+        last_was_match = false;
+    }
+
+    // Copied bytes are never predicted; only contexts move forward
+    void update_match(const uint8_t* data, uint32_t len) {
+        char_model.update_bulk(data, len);
+        word_model.update_bulk(data, len);
+        for (uint32_t i = 0; i < len; i++) xml_parser.update(data[i]);
+        literal_count = 0;
+        last_was_match = true;
+    }
+
+    void process_data(const uint8_t* data, size_t size) {
+        for (size_t i = 0; i < size;) {
+            // Overlap the literal path's first cache misses with the search
             uint32_t xml_context = xml_parser.current_context();
-            
-            // Check for match continuation
-            if (last_match_len > 0) {
-                last_match_len--;
-                continue;
-            }
-            
-            // Find new matches
+            char_model.prefetch();
+            word_model.prefetch(xml_context);
+
             uint32_t match_len = 0;
-            uint32_t match_pos = match_finder.find_match(data, i, size - i, match_len);
-            
-            if (match_len >= 4) {
-                // Encode match
-                ans.encode_symbol(1, 0x800);  // Match flag
-                // Encode match length and position
-                last_match_pos = match_pos;
-                last_match_len = match_len;
-                i += match_len - 1;
-                literal_count = 0;
+            uint32_t match_dist = match_finder.find_match(data, i, size, match_len);
+
+            if (match_len >= MIN_MATCH) {
+                ans.encode_symbol(1, zero_prob(flag_prob()));
+                adapt_prob(flag_prob(), 1, 5);
+                length_model.encode(ans, match_len - MIN_MATCH + 1);
+                distance_model.encode(ans, match_dist);
+
+                match_finder.insert(data, i, match_len, size);
+                update_match(data + i, match_len);
+                i += match_len;
             } else {
-                // Encode literal
-                if (literal_count == 0) {
-                    ans.encode_symbol(0, 0x800);  // Literal flag
+                ans.encode_symbol(0, zero_prob(flag_prob()));
+                adapt_prob(flag_prob(), 0, 5);
+
+                uint32_t c0 = 1;
+                for (int bit = 7; bit >= 0; bit--) {
+                    int b = (data[i] >> bit) & 1;
+                    ans.encode_symbol(b, zero_prob(predict_bit(c0, xml_context)));
+                    update_bit(b);
+                    c0 = (c0 << 1) | b;
                 }
-                
-                uint16_t char_prob = char_model.predict();
-                uint16_t word_prob = word_model.predict();
-                uint16_t combined = (char_prob + word_prob + xml_context) / 3;
-                
-                ans.encode_symbol(data[i], combined);
-                
-                char_model.update(data[i]);
-                word_model.update(data[i]);
-                literal_count = (literal_count + 1) & 0xF;
+
+                match_finder.insert(data, i, 1, size);
+                update_literal(data[i]);
+                i++;
             }
-            
-            // Update match finder
-            match_finder.update(data + i, 0, 1);
         }
     }
 
+    [[noreturn]] static void corrupt_stream() {
+        fprintf(stderr, "Corrupt CM stream\n");
+        exit(1);
+    }
+
 public:
     Wikilator(FILE* in, FILE* out, bool compress)
-        : ans(out), input_file(in), compression_mode(compress) {
+        : ans(out), match_finder(compress), input_file(in), output_file(out),
+          compression_mode(compress) {
+        std::fill_n(match_flag, 32, 0x8000);
+
         struct stat st;
         fstat(fileno(in), &st);
         input_size = st.st_size;
+        if (input_size == 0) return;
         
         // Memory map the input file
         input_map = static_cast<uint8_t*>(mmap(nullptr, input_size, 
@@ -422,31 +757,474 @@ public:
     }
 
     void compress() {
-        // Process in cache-sized chunks
-        const size_t chunk_size = L2_CACHE * 4;
-        for (size_t offset = 0; offset < input_size; offset += chunk_size) {
-            size_t size = std::min(chunk_size, input_size - offset);
-            process_data(input_map + offset, size);
-        }
+        uint64_t size = input_size;
+        fwrite(&size, sizeof(size), 1, output_file);
+        process_data(input_map, input_size);
         ans.flush();
     }
 
     void decompress() {
-        // Placeholder - would be the inverse of compression
-        // For now just compress again to have a working binary
-        compress();
+        // Skip the engine tag already checked by main()
+        uint64_t size;
+        if (input_size < 1 + sizeof(size)) corrupt_stream();
+        memcpy(&size, input_map + 1, sizeof(size));
+        ans.begin_decode(input_map + 1 + sizeof(size), input_size - 1 - sizeof(size));
+
+        const size_t buf_size = 1 << 20;
+        uint8_t* out = static_cast<uint8_t*>(mem_manager.allocate(buf_size + MAX_MATCH));
+        size_t out_pos = 0;
+
+        for (uint64_t done = 0; done < size;) {
+            if (ans.decode_symbol(zero_prob(flag_prob()))) {
+                adapt_prob(flag_prob(), 1, 5);
+                uint64_t len = length_model.decode(ans) + MIN_MATCH - 1;
+                uint32_t dist = distance_model.decode(ans);
+                if (len > MAX_MATCH || len > size - done || dist > done || dist >= WINDOW_SIZE)
+                    corrupt_stream();
+
+                match_finder.copy(out + out_pos, dist, len);
+                update_match(out + out_pos, len);
+                out_pos += len;
+                done += len;
+            } else {
+                adapt_prob(flag_prob(), 0, 5);
+
+                uint32_t xml_context = xml_parser.current_context();
+                uint32_t c0 = 1;
+                for (int bit = 7; bit >= 0; bit--) {
+                    int b = ans.decode_symbol(zero_prob(predict_bit(c0, xml_context)));
+                    update_bit(b);
+                    c0 = (c0 << 1) | b;
+                }
+
+                uint8_t byte = c0 & 0xFF;
+                out[out_pos++] = byte;
+                match_finder.update(&byte, 1);
+                update_literal(byte);
+                done++;
+            }
+
+            if (out_pos >= buf_size) {
+                fwrite(out, 1, out_pos, output_file);
+                out_pos = 0;
+            }
+        }
+        fwrite(out, 1, out_pos, output_file);
+    }
+};
+
+// ====================== Suffix Array ========================
+// SA-IS (Nong, Zhang & Chan) over one block with an implicit sentinel.
+// All recursion scratch comes from a per-instance arena carved out of
+// mem_manager up front, so instances can run on separate threads.
+class SuffixArray {
+private:
+    uint8_t* scratch = nullptr;
+    size_t scratch_size = 0;
+    size_t scratch_top = 0;
+
+    // Block bytes shifted up by one, with the sentinel 0 at position n
+    struct ByteText {
+        const uint8_t* data;
+        int32_t n;
+        int32_t operator[](int32_t i) const { return i < n ? data[i] + 1 : 0; }
+    };
+
+    // Reduced string of LMS names (already ends in a unique 0)
+    struct NameText {
+        const int32_t* names;
+        int32_t operator[](int32_t i) const { return names[i]; }
+    };
+
+    void* take(size_t size) {
+        size_t offset = (scratch_top + 15) & ~size_t(15);
+        if (offset + size > scratch_size) {
+            fprintf(stderr, "Suffix array scratch exhausted! Requested: %zu, Free: %zu\n",
+                    size, scratch_size - scratch_top);
+            exit(1);
+        }
+        scratch_top = offset + size;
+        return scratch + offset;
+    }
+
+    template <typename Text>
+    static void get_buckets(const Text& s, int32_t* bkt, int32_t n, int32_t K, bool end) {
+        memset(bkt, 0, (K + 1) * sizeof(int32_t));
+        for (int32_t i = 0; i < n; i++) bkt[s[i]]++;
+        int32_t sum = 0;
+        for (int32_t i = 0; i <= K; i++) {
+            sum += bkt[i];
+            bkt[i] = end ? sum : sum - bkt[i];
+        }
+    }
+
+    template <typename Text>
+    void sais(const Text& s, int32_t* SA, int32_t n, int32_t K) {
+        size_t mark = scratch_top;
+        uint8_t* t = static_cast<uint8_t*>(take(n / 8 + 1));
+        int32_t* bkt = static_cast<int32_t*>(take((K + 1) * sizeof(int32_t)));
+
+        auto tget = [t](int32_t i) { return (t[i >> 3] >> (i & 7)) & 1; };
+        auto tset = [t](int32_t i, int b) {
+            if (b) t[i >> 3] |= 1 << (i & 7);
+            else t[i >> 3] &= ~(1 << (i & 7));
+        };
+        auto is_lms = [&](int32_t i) { return i > 0 && tget(i) && !tget(i - 1); };
+
+        auto induce = [&]() {
+            get_buckets(s, bkt, n, K, false);
+            for (int32_t i = 0; i < n; i++) {
+                int32_t j = SA[i] - 1;
+                if (j >= 0 && !tget(j)) SA[bkt[s[j]]++] = j;
+            }
+            get_buckets(s, bkt, n, K, true);
+            for (int32_t i = n - 1; i >= 0; i--) {
+                int32_t j = SA[i] - 1;
+                if (j >= 0 && tget(j)) SA[--bkt[s[j]]] = j;
+            }
+        };
+
+        // Classify suffixes as S (1) or L (0)
+        tset(n - 2, 0);
+        tset(n - 1, 1);
+        for (int32_t i = n - 3; i >= 0; i--)
+            tset(i, (s[i] < s[i + 1] || (s[i] == s[i + 1] && tget(i + 1))) ? 1 : 0);
+
+        // Stage 1: sort LMS substrings
+        get_buckets(s, bkt, n, K, true);
+        for (int32_t i = 0; i < n; i++) SA[i] = -1;
+        for (int32_t i = 1; i < n; i++)
+            if (is_lms(i)) SA[--bkt[s[i]]] = i;
+        induce();
+
+        int32_t n1 = 0;
+        for (int32_t i = 0; i < n; i++)
+            if (is_lms(SA[i])) SA[n1++] = SA[i];
+
+        // Name LMS substrings
+        for (int32_t i = n1; i < n; i++) SA[i] = -1;
+        int32_t name = 0, prev = -1;
+        for (int32_t i = 0; i < n1; i++) {
+            int32_t pos = SA[i];
+            bool diff = false;
+            for (int32_t d = 0; d < n; d++) {
+                if (prev == -1 || s[pos + d] != s[prev + d] || tget(pos + d) != tget(prev + d)) {
+                    diff = true;
+                    break;
+                }
+                if (d > 0 && (is_lms(pos + d) || is_lms(prev + d))) break;
+            }
+            if (diff) {
+                name++;
+                prev = pos;
+            }
+            SA[n1 + pos / 2] = name - 1;
+        }
+        for (int32_t i = n - 1, j = n - 1; i >= n1; i--)
+            if (SA[i] >= 0) SA[j--] = SA[i];
+
+        // Stage 2: sort the reduced string, recursing while names repeat
+        int32_t* SA1 = SA;
+        int32_t* s1 = SA + n - n1;
+        if (name < n1) {
+            sais(NameText{s1}, SA1, n1, name - 1);
+        } else {
+            for (int32_t i = 0; i < n1; i++) SA1[s1[i]] = i;
+        }
+
+        // Stage 3: induce the full order from the sorted LMS suffixes
+        get_buckets(s, bkt, n, K, true);
+        for (int32_t i = 1, j = 0; i < n; i++)
+            if (is_lms(i)) s1[j++] = i;
+        for (int32_t i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+        for (int32_t i = n1; i < n; i++) SA[i] = -1;
+        for (int32_t i = n1 - 1; i >= 0; i--) {
+            int32_t j = SA[i];
+            SA[i] = -1;
+            SA[--bkt[s[j]]] = j;
+        }
+        induce();
+
+        scratch_top = mark;
+    }
+
+public:
+    // Bit types plus bucket arrays over all recursion levels (each level
+    // at most halves the string)
+    static size_t scratch_bytes(size_t block_size) {
+        return (block_size + 1) / 4 + (block_size + 1) * sizeof(int32_t) + 4096;
+    }
+
+    void reserve(size_t block_size) {
+        scratch_size = scratch_bytes(block_size);
+        scratch = static_cast<uint8_t*>(mem_manager.allocate(scratch_size, 64));
+    }
+
+    // Fills SA[0..n] with the suffix order of data + sentinel; SA[0] == n
+    void build(const uint8_t* data, int32_t n, int32_t* SA) {
+        scratch_top = 0;
+        sais(ByteText{data, n}, SA, n + 1, 256);
+    }
+};
+
+// ====================== BWT Engine ========================
+// High-throughput alternative to the context-mixing path. The input is cut
+// into BWT_BLOCK_SIZE blocks that are transformed independently, one per
+// thread: suffix array -> BWT -> MTF + zero-run RLE -> ANS block coding.
+// Stream: ENGINE_BWT, then per block a header {raw_size, primary,
+// symbols, payload_size} (uint32) followed by the payload.
+class BWTEngine {
+private:
+    FILE* input_file;
+    FILE* output_file;
+    size_t input_size;
+    uint8_t* input_map = nullptr;
+
+    struct Worker {
+        SuffixArray suffix_array;
+        int32_t* suffixes = nullptr;    // SA on encode, LF links on decode
+        uint8_t* bwt = nullptr;
+        uint16_t* symbols = nullptr;
+        uint8_t* out = nullptr;         // packed payload / decoded block
+        size_t out_cap = 0;
+
+        // Per-block job
+        const uint8_t* src = nullptr;
+        uint32_t header[4] = {0};       // raw_size, primary, symbols, payload_size
+    };
+
+    std::vector<Worker> workers;
+
+    static size_t worker_bytes(bool encode) {
+        size_t n = BWT_BLOCK_SIZE;
+        size_t common = (n + 1) * sizeof(int32_t) + n + n * sizeof(uint16_t);
+        if (encode)
+            return common + SuffixArray::scratch_bytes(n) + ANS::block_bound(n, BWT_ALPHABET);
+        return common + n;
+    }
+
+    // One worker per core, bounded by block count and the remaining RAM
+    // budget (less one worker's worth lost to the pool tail)
+    void create_workers(size_t blocks, bool encode) {
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t budget = mem_manager.remaining() / worker_bytes(encode);
+        threads = std::min(threads, std::max<size_t>(1, blocks));
+        threads = std::min(threads, std::max<size_t>(1, budget > 1 ? budget - 1 : 1));
+
+        workers.resize(threads);
+        for (Worker& w : workers) {
+            size_t n = BWT_BLOCK_SIZE;
+            w.suffixes = static_cast<int32_t*>(mem_manager.allocate((n + 1) * sizeof(int32_t)));
+            w.bwt = static_cast<uint8_t*>(mem_manager.allocate(n));
+            w.symbols = static_cast<uint16_t*>(mem_manager.allocate(n * sizeof(uint16_t)));
+            if (encode) {
+                w.suffix_array.reserve(n);
+                w.out_cap = ANS::block_bound(n, BWT_ALPHABET);
+            } else {
+                w.out_cap = n;
+            }
+            w.out = static_cast<uint8_t*>(mem_manager.allocate(w.out_cap));
+        }
+    }
+
+    // Runs job(w) for the first `count` workers, the last one on this thread
+    template <typename Job>
+    void run_batch(size_t count, Job job) {
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t + 1 < count; t++)
+            threads.emplace_back(job, std::ref(workers[t]));
+        job(workers[count - 1]);
+        for (std::thread& th : threads) th.join();
+    }
+
+    static void encode_block(Worker& w) {
+        int32_t n = w.header[0];
+        w.suffix_array.build(w.src, n, w.suffixes);
+
+        // BWT: last column of the sorted rotations, sentinel row dropped
+        uint32_t primary = 0;
+        for (int32_t i = 0, o = 0; i <= n; i++) {
+            int32_t j = w.suffixes[i];
+            if (j == 0) primary = i;
+            else w.bwt[o++] = w.src[j - 1];
+        }
+
+        // MTF, with runs of rank 0 written in bijective base 2 (RUNA/RUNB)
+        uint8_t order[256];
+        for (int i = 0; i < 256; i++) order[i] = i;
+        size_t count = 0;
+        uint32_t run = 0;
+        auto flush_run = [&]() {
+            while (run > 0) {
+                w.symbols[count++] = (run & 1) ? 0 : 1;
+                run = (run - 1) >> 1;
+            }
+        };
+        for (int32_t i = 0; i < n; i++) {
+            uint8_t c = w.bwt[i];
+            if (order[0] == c) {
+                run++;
+                continue;
+            }
+            flush_run();
+            int rank = 1;
+            while (order[rank] != c) rank++;
+            memmove(order + 1, order, rank);
+            order[0] = c;
+            w.symbols[count++] = rank + 1;
+        }
+        flush_run();
+
+        w.header[1] = primary;
+        w.header[2] = count;
+        w.header[3] = ANS::encode_block(w.symbols, count, BWT_ALPHABET, w.out, w.out_cap);
+    }
+
+    static void decode_block(Worker& w) {
+        uint32_t n = w.header[0];
+        uint32_t primary = w.header[1];
+        size_t count = w.header[2];
+        if (ANS::decode_block(w.src, w.header[3], w.symbols, count, BWT_ALPHABET) != w.header[3])
+            corrupt_stream();
+
+        // Undo RLE + MTF
+        uint8_t order[256];
+        for (int i = 0; i < 256; i++) order[i] = i;
+        uint32_t pos = 0;
+        uint32_t run = 0, weight = 1;
+        for (size_t i = 0; i <= count; i++) {
+            uint16_t sym = i < count ? w.symbols[i] : BWT_ALPHABET;
+            if (sym <= 1) {
+                run += weight << sym;
+                weight <<= 1;
+                if (run > n) corrupt_stream();
+                continue;
+            }
+            if (run > n - pos) corrupt_stream();
+            memset(w.bwt + pos, order[0], run);
+            pos += run;
+            run = 0;
+            weight = 1;
+            if (sym == BWT_ALPHABET) break;
+            if (pos == n) corrupt_stream();
+            int rank = sym - 1;
+            uint8_t c = order[rank];
+            memmove(order + 1, order, rank);
+            order[0] = c;
+            w.bwt[pos++] = c;
+        }
+        if (pos != n || primary > n) corrupt_stream();
+
+        // Inverse BWT: each entry packs (next row << 8) | first-column byte
+        uint32_t first[256] = {0};
+        for (uint32_t i = 0; i < n; i++) first[w.bwt[i]]++;
+        for (uint32_t c = 0, sum = 1; c < 256; c++) {
+            uint32_t k = first[c];
+            first[c] = sum;
+            sum += k;
+        }
+        uint32_t* links = reinterpret_cast<uint32_t*>(w.suffixes);
+        for (uint32_t row = 0; row <= n; row++) {
+            if (row == primary) continue;
+            uint8_t c = w.bwt[row < primary ? row : row - 1];
+            links[first[c]++] = (row << 8) | c;
+        }
+        for (uint32_t i = 0, row = primary; i < n; i++) {
+            uint32_t e = links[row];
+            w.out[i] = e & 0xFF;
+            row = e >> 8;
+        }
+    }
+
+    [[noreturn]] static void corrupt_stream() {
+        fprintf(stderr, "Corrupt BWT stream\n");
+        exit(1);
+    }
+
+public:
+    BWTEngine(FILE* in, FILE* out) : input_file(in), output_file(out) {
+        struct stat st;
+        fstat(fileno(in), &st);
+        input_size = st.st_size;
+        if (input_size == 0) return;
+
+        input_map = static_cast<uint8_t*>(mmap(nullptr, input_size,
+            PROT_READ, MAP_PRIVATE, fileno(in), 0));
+        if (input_map == MAP_FAILED) {
+            perror("mmap failed");
+            exit(1);
+        }
+    }
+
+    ~BWTEngine() {
+        if (input_map) munmap(input_map, input_size);
+    }
+
+    void compress() {
+        size_t blocks = (input_size + BWT_BLOCK_SIZE - 1) / BWT_BLOCK_SIZE;
+        if (blocks == 0) return;
+        create_workers(blocks, true);
+
+        for (size_t first = 0; first < blocks; first += workers.size()) {
+            size_t batch = std::min(workers.size(), blocks - first);
+            for (size_t t = 0; t < batch; t++) {
+                size_t offset = (first + t) * BWT_BLOCK_SIZE;
+                workers[t].src = input_map + offset;
+                workers[t].header[0] = std::min(BWT_BLOCK_SIZE, input_size - offset);
+            }
+            run_batch(batch, encode_block);
+            for (size_t t = 0; t < batch; t++) {
+                fwrite(workers[t].header, sizeof(uint32_t), 4, output_file);
+                fwrite(workers[t].out, 1, workers[t].header[3], output_file);
+            }
+        }
+    }
+
+    void decompress() {
+        // Skip the engine tag already checked by main(), then validate and
+        // record every block header so workers match the real block count
+        std::vector<size_t> offsets;
+        for (size_t pos = 1; pos < input_size;) {
+            uint32_t header[4];
+            if (input_size - pos < sizeof(header)) corrupt_stream();
+            memcpy(header, input_map + pos, sizeof(header));
+            if (header[0] == 0 || header[0] > BWT_BLOCK_SIZE || header[2] > header[0] ||
+                header[3] > input_size - pos - sizeof(header))
+                corrupt_stream();
+            offsets.push_back(pos);
+            pos += sizeof(header) + header[3];
+        }
+        if (offsets.empty()) return;
+        create_workers(offsets.size(), false);
+
+        for (size_t first = 0; first < offsets.size(); first += workers.size()) {
+            size_t batch = std::min(workers.size(), offsets.size() - first);
+            for (size_t t = 0; t < batch; t++) {
+                Worker& w = workers[t];
+                memcpy(w.header, input_map + offsets[first + t], sizeof(w.header));
+                w.src = input_map + offsets[first + t] + sizeof(w.header);
+            }
+            run_batch(batch, decode_block);
+            for (size_t t = 0; t < batch; t++)
+                fwrite(workers[t].out, 1, workers[t].header[0], output_file);
+        }
     }
 };
 
 // ====================== CLI Interface ========================
 int main(int argc, char** argv) {
     if (argc != 4) {
-        fprintf(stderr, "Usage: %s -c/-d input output\n", argv[0]);
+        fprintf(stderr, "Usage: %s -c/-f/-d input output\n", argv[0]);
+        fprintf(stderr, "  -c  compress (context mixing)\n");
+        fprintf(stderr, "  -f  compress (fast BWT, multi-threaded)\n");
+        fprintf(stderr, "  -d  decompress (engine read from the stream)\n");
         return 1;
     }
 
     bool compress = false;
+    uint8_t engine_tag = ENGINE_CM;
     if (strcmp(argv[1], "-c") == 0) compress = true;
+    else if (strcmp(argv[1], "-f") == 0) { compress = true; engine_tag = ENGINE_BWT; }
     else if (strcmp(argv[1], "-d") == 0) compress = false;
     else {
         fprintf(stderr, "Invalid option: %s\n", argv[1]);
@@ -461,14 +1239,34 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    if (compress) {
+        fputc(engine_tag, out);
+    } else {
+        int tag = fgetc(in);
+        if (tag != ENGINE_CM && tag != ENGINE_BWT) {
+            fprintf(stderr, "Unknown stream format\n");
+            return 1;
+        }
+        engine_tag = tag;
+    }
+
     // Pre-allocate memory pool for better performance
     mem_manager.create_pool(MAX_RAM * 3 / 4);
 
-    Wikilator engine(in, out, compress);
-    if (compress) {
-        engine.compress();
+    if (engine_tag == ENGINE_BWT) {
+        BWTEngine engine(in, out);
+        if (compress) {
+            engine.compress();
+        } else {
+            engine.decompress();
+        }
     } else {
-        engine.decompress();
+        Wikilator engine(in, out, compress);
+        if (compress) {
+            engine.compress();
+        } else {
+            engine.decompress();
+        }
     }
 
     fclose(in);